@@ -18,27 +18,49 @@
 #define I2C_SDA_BIT           5
 #define I2C_SCL_BIT           2
 
-HAL_GPIO_PIN(RX,              A, 24);
-HAL_GPIO_PIN(TX,              A, 25);
+HAL_GPIO_PIN(RX,              A, 25); // PAD3
+HAL_GPIO_PIN(TX,              A, 24); // PAD2
+#define BL_FLOW_CONTROL       0 // 1: RTS/CTS on the pins below, low is ready
+HAL_GPIO_PIN(RTS,             A, 22); // Output, to CTS of the host
+HAL_GPIO_PIN(CTS,             A, 23); // Input, from RTS of the host
 #define BL_SERCOM             SERCOM1
 #define SERCOM_PMUX           HAL_GPIO_PMUX_C
 #define SERCOM_GCLK_ID        SERCOM1_GCLK_ID_CORE
 #define SERCOM_CLK_GEN        0
 #define SERCOM_APBCMASK       PM_APBCMASK_SERCOM1
 #define BAUD_RATE             57600
+#define BAUD_RATE_MIN         9600
+#define BAUD_RATE_MAX         (F_CPU / 8) // 8x oversampling
+#define BL_SET_BAUD           1 // BL_CMD_BAUD, rates negotiated at runtime
+#define BL_TIMEOUT            (F_CPU / 2) // SysTick cycles, 0.5s
 
-#define APPLICATION_START     0x400
+#define APPLICATION_START     0x800 // See linker/samd10d14.ld
 #define PAGES_IN_ERASE_BLOCK  4
 #define ERASE_BLOCK_SIZE      (FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK)
 #define DATA_SIZE             64
+#define BL_WINDOW             4 // Page buffers, 80 bytes of RAM each
+#define BL_VERIFY_WRITE       1 // CRC of the written page as well
+#define BL_STATS              1 // BL_CMD_STATS, receive overrun counter
+#define BL_ROW_CRCS           1 // BL_CMD_CRCS, CRC32 of every application row
+#define BL_RANGE_CRC          1 // BL_CMD_CRC, CRC32 of any word aligned range
 #define BL_REQUEST            0xDEADBEEF
+#define BL_VERSION            2
 
 enum
 {
   BL_CMD_SOF    = 0xa0,
   BL_CMD_DATA   = 0xa1,
   BL_CMD_RESET  = 0xa2,
+  BL_CMD_WINDOW = 0xa3,
+  BL_CMD_PAGE   = 0xa4,
+  BL_CMD_INFO   = 0xa5,
+  BL_CMD_BAUD   = 0xa6,
+  BL_CMD_STATS  = 0xa7,
+  BL_CMD_CRCS   = 0xa8,
+  BL_CMD_CRC    = 0xa9,
   BL_CMD_ACK    = 0x55,
+  BL_CMD_SAME   = 0x56, // Page already in flash, nothing written
+  BL_CMD_ERASED = 0x57, // Programmed after erasing its row
   BL_CMD_NACK   = 0x66,
   BL_CMD_FLASH  = 0x77,
 };
@@ -46,157 +68,490 @@ enum
 enum
 {
   BL_STATUS_READY      = (1 << 0),
-  BL_STATUS_ADDR       = (1 << 1),
+  BL_STATUS_HEADER     = (1 << 1),
   BL_STATUS_DATA       = (1 << 2),
   BL_STATUS_CRC        = (1 << 3),
-  BL_STATUS_CRC_OK     = (1 << 4),
 };
 
+enum
+{
+  BL_FLAG_FRAME        = (1 << 0), // Followed by a page and its CRC
+  BL_FLAG_SEQ          = (1 << 1), // Replies carry the sequence number
+};
+
+typedef struct
+{
+  uint8_t cmd;
+  uint8_t size; // Header bytes after the command
+  uint8_t flags;
+} bl_command_t;
+
+enum
+{
+  BL_FRAME_FREE,
+  BL_FRAME_QUEUED,
+  BL_FRAME_PROGRAM,
+  BL_FRAME_VERIFY,
+};
+
+#define BL_CAP_FLOW           (1ul << 31) // INFO capability, no command
+
+typedef struct
+{
+  uint8_t state;
+  uint8_t cmd;
+  uint8_t flags;
+  uint8_t seq;
+  uint8_t status;
+  uint32_t addr;
+  uint32_t crc;
+} bl_frame_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static uint32_t *ram = (uint32_t *)HMCRAMC0_ADDR;
 static uint8_t bl_status = BL_STATUS_READY;
 
+/*
+ * Every command, the length of its header and how it is handled. Frame
+ * headers start with the page address, BL_FLAG_SEQ ones follow it with the
+ * sequence number. Bytes that are not a command are skipped.
+ */
+static const bl_command_t bl_commands[] =
+{
+  { BL_CMD_SOF,    4, BL_FLAG_FRAME },
+  { BL_CMD_RESET,  0, 0 },
+  { BL_CMD_WINDOW, 5, BL_FLAG_FRAME | BL_FLAG_SEQ },
+  { BL_CMD_PAGE,   4, BL_FLAG_FRAME },
+  { BL_CMD_INFO,   0, 0 },
+#if BL_SET_BAUD
+  { BL_CMD_BAUD,   4, 0 },
+#endif
+#if BL_STATS
+  { BL_CMD_STATS,  0, 0 },
+#endif
+#if BL_ROW_CRCS
+  { BL_CMD_CRCS,   0, 0 },
+#endif
+#if BL_RANGE_CRC
+  { BL_CMD_CRC,    8, 0 },
+#endif
+};
+
+static const bl_command_t *bl_command;
+static uint32_t bl_header[2]; // Little endian, like the host sends words
+static uint8_t *bl_dst;
+static uint8_t bl_left = 0;
+
+/*
+ * Frames are received into frames[frame_rx] and programmed from
+ * frames[frame_nvm], both advance round-robin. This lets the next page
+ * arrive while NVMCTRL is still busy with the previous one. The host may
+ * have BL_WINDOW frames in flight, more than two also cover the reply
+ * latency of USB-serial adapters at high baud rates.
+ */
+static bl_frame_t frames[BL_WINDOW];
+static uint32_t frame_data[BL_WINDOW][DATA_SIZE / 4];
+static uint8_t frame_rx = 0;
+static uint8_t frame_nvm = 0;
 
-static uint8_t flash_buffer[DATA_SIZE];
-static uint32_t flash_addr = 0;
-static uint32_t flash_crc = 0;
-static uint8_t flash_offset = 0;
+#if BL_STATS
+static uint16_t rx_overruns = 0;
+#endif
 
 /*- Implementations ---------------------------------------------------------*/
 //-----------------------------------------------------------------------------
+// Not inlined, the callers are many and the CTS wait grows it.
+__attribute__ ((noinline))
 static void uart_putc(char c) {
+#if BL_FLOW_CONTROL
+  while (HAL_GPIO_CTS_read());
+#endif
   while (!(BL_SERCOM->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_DRE));
   BL_SERCOM->USART.DATA.reg = c;
 }
 
 //-----------------------------------------------------------------------------
-static void sys_init(void)
+// Words go out least significant byte first, like the host sends them.
+static void uart_put32(uint32_t value)
+{
+  for (int i = 0; i < 32; i += 8)
+    uart_putc(value >> i);
+}
+
+//-----------------------------------------------------------------------------
+static int uart_getc(void)
+{
+#if BL_STATS
+  if (BL_SERCOM->USART.STATUS.reg & SERCOM_USART_STATUS_BUFOVF) {
+    BL_SERCOM->USART.STATUS.reg = SERCOM_USART_STATUS_BUFOVF;
+    rx_overruns++;
+  }
+#endif
+  if (!(BL_SERCOM->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_RXC))
+    return -1;
+  return BL_SERCOM->USART.DATA.reg;
+}
+
+//-----------------------------------------------------------------------------
+static void uart_set_baud(uint32_t baud)
+{
+  uint32_t rest = 8 * baud;
+  uint32_t br = 0;
+
+  // 65536 * samples * baud / F_CPU by long division, the M0+ cannot divide.
+  for (int i = 0; i < 16; i++) {
+    rest <<= 1;
+    br <<= 1;
+    if (rest >= F_CPU) {
+      rest -= F_CPU;
+      br |= 1;
+    }
+  }
+
+  BL_SERCOM->USART.CTRLA.reg &= ~SERCOM_USART_CTRLA_ENABLE;
+  while (BL_SERCOM->USART.SYNCBUSY.reg & SERCOM_USART_SYNCBUSY_ENABLE);
+
+  BL_SERCOM->USART.CTRLA.reg =
+    SERCOM_USART_CTRLA_DORD | SERCOM_USART_CTRLA_MODE_USART_INT_CLK |
+    SERCOM_USART_CTRLA_RXPO(3/*PAD3*/) | SERCOM_USART_CTRLA_TXPO(1/*PAD2*/) |
+    SERCOM_USART_CTRLA_SAMPR(2/*8x arithmetic*/);
+  BL_SERCOM->USART.BAUD.reg = 65536 - br;
+  BL_SERCOM->USART.CTRLA.reg |= SERCOM_USART_CTRLA_ENABLE;
+  while (BL_SERCOM->USART.SYNCBUSY.reg & SERCOM_USART_SYNCBUSY_ENABLE);
+}
+
+//-----------------------------------------------------------------------------
+// True once BL_TIMEOUT passed since SysTick->VAL was last written.
+static bool bl_timeout(void)
+{
+  return SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk;
+}
+
+#if BL_SET_BAUD
+//-----------------------------------------------------------------------------
+static void uart_switch_baud(uint32_t baud)
 {
-  uint64_t br = (uint64_t)65536 * (F_CPU - 16 * BAUD_RATE) / F_CPU;
+  int probe;
+
+  if (baud < BAUD_RATE_MIN || baud > BAUD_RATE_MAX) {
+    uart_putc(BL_CMD_NACK);
+    return;
+  }
+
+  // The ACK still goes out at the old rate.
+  BL_SERCOM->USART.INTFLAG.reg = SERCOM_USART_INTFLAG_TXC;
+  uart_putc(BL_CMD_ACK);
+  while (!(BL_SERCOM->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_TXC));
+  uart_set_baud(baud);
+
+  // The host confirms the new rate with a probe that is echoed back.
+  SysTick->VAL = 0;
+  while ((probe = uart_getc()) < 0 && !bl_timeout());
+  if (BL_CMD_ACK == probe) {
+    uart_putc(BL_CMD_ACK);
+    return;
+  }
 
+  uart_set_baud(BAUD_RATE);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static void sys_init(void)
+{
   SYSCTRL->OSC8M.bit.PRESC = 0;
   PAC1->WPCLR.reg = PAC1->WPCLR.reg;
   PM->AHBMASK.reg |= PM_AHBMASK_NVMCTRL | PM_AHBMASK_DSU;
   PM->APBBMASK.reg |= PM_APBBMASK_NVMCTRL | PM_APBBMASK_DSU;
-  NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CACHEDIS;
+  NVMCTRL->CTRLB.reg = NVMCTRL_CTRLB_CACHEDIS | NVMCTRL_CTRLB_MANW;
 
   HAL_GPIO_RX_pmuxen(SERCOM_PMUX);
   HAL_GPIO_TX_pmuxen(SERCOM_PMUX);
+#if BL_FLOW_CONTROL
+  HAL_GPIO_RTS_set();
+  HAL_GPIO_RTS_out();
+  HAL_GPIO_CTS_in();
+  HAL_GPIO_CTS_pullup();
+#endif
 
   PM->APBCMASK.reg |= SERCOM_APBCMASK;
 
   GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(SERCOM_GCLK_ID) |
       GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN(SERCOM_CLK_GEN);
 
-
-  BL_SERCOM->USART.CTRLA.reg =
-    SERCOM_USART_CTRLA_DORD | SERCOM_USART_CTRLA_MODE_USART_INT_CLK |
-    SERCOM_USART_CTRLA_RXPO(3/*PAD3*/) | SERCOM_USART_CTRLA_TXPO(1/*PAD2*/);
-
   BL_SERCOM->USART.CTRLB.reg = SERCOM_USART_CTRLB_RXEN | SERCOM_USART_CTRLB_TXEN |
     SERCOM_USART_CTRLB_CHSIZE(0/*8 bits*/);
-  BL_SERCOM->USART.BAUD.reg = (uint16_t)br+1;
-  BL_SERCOM->USART.CTRLA.reg |= SERCOM_USART_CTRLA_ENABLE;
+  uart_set_baud(BAUD_RATE);
+
+  SysTick->LOAD = BL_TIMEOUT - 1;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
   uart_putc(bl_status);
 }
 
-static void uart_task(void)
+//-----------------------------------------------------------------------------
+// CRC32 of a word aligned flash or RAM range, the same as binascii.crc32().
+// Not inlined, each of its callers would get a copy.
+__attribute__ ((noinline))
+static uint32_t dsu_crc(uint32_t addr, uint32_t size)
 {
-  // Wait for complete frame.
-  while(bl_status != BL_STATUS_CRC_OK) {
-    // Wait until a char is available
-    while(!(BL_SERCOM->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_RXC));
-    // Read the char
-    uint8_t data = BL_SERCOM->USART.DATA.reg;
-    // Process the char according to the current state
-    if (bl_status == BL_STATUS_READY && data == BL_CMD_RESET) {
-      ram[0] = ram[1] = ram[2] = ram[3] = 0;
-      NVIC_SystemReset();
-      break;
-    }
-    if (bl_status == BL_STATUS_READY && data == BL_CMD_SOF) {
-      bl_status = BL_STATUS_ADDR;
-      flash_offset = 0;
-      flash_addr = 0;
-      uart_putc(BL_CMD_ACK);
-      continue;
-    }
-    if (bl_status == BL_STATUS_ADDR) {
-      flash_addr |= (data << flash_offset);
-      flash_offset += 8;
-      if (flash_offset == 32) {
-        bl_status = BL_STATUS_DATA;
-        flash_offset = 0;
-        uart_putc(BL_CMD_ACK);
-      }
-      continue;
-    }
-    if (bl_status == BL_STATUS_DATA) {
-      flash_buffer[flash_offset] = data;
-      flash_offset++;
-      if (flash_offset == DATA_SIZE) {
-        bl_status = BL_STATUS_CRC;
-        flash_offset = 0;
-        flash_crc = 0;
-        uart_putc(BL_CMD_ACK);
+  DSU->STATUSA.reg = DSU_STATUSA_DONE | DSU_STATUSA_BERR;
+  DSU->ADDR.reg = addr;
+  DSU->DATA.reg = 0xFFFFFFFF;
+  DSU->LENGTH.reg = size;
+  DSU->CTRL.reg = DSU_CTRL_CRC;
+
+  while (!(DSU->STATUSA.reg & DSU_STATUSA_DONE));
+
+  return ~DSU->DATA.reg;
+}
+
+//-----------------------------------------------------------------------------
+// One CRC32 per chunk of the range, no count or terminator.
+static void uart_put_crcs(uint32_t addr, uint32_t size, uint32_t chunk)
+{
+  for (; size; addr += chunk, size -= chunk)
+    uart_put32(dsu_crc(addr, chunk));
+}
+
+//-----------------------------------------------------------------------------
+static void flash_command(uint32_t addr, uint32_t cmd)
+{
+  while (0 == NVMCTRL->INTFLAG.bit.READY);
+  NVMCTRL->ADDR.reg = addr >> 1;
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | cmd;
+}
+
+//-----------------------------------------------------------------------------
+static void flash_write_page(uint32_t addr, const uint32_t *data)
+{
+  uint32_t *flash_buf = (uint32_t *)addr;
+
+  // Manual write, the page buffer only goes to flash with the command.
+  for (int i = 0; i < FLASH_PAGE_SIZE / 4; i++)
+    flash_buf[i] = data[i];
+  flash_command(addr, NVMCTRL_CTRLA_CMD_WP);
+}
+
+//-----------------------------------------------------------------------------
+static void frame_status(bl_frame_t *frame)
+{
+  uart_putc(frame->status);
+  if (frame->flags & BL_FLAG_SEQ)
+    uart_putc(frame->seq);
+}
+
+//-----------------------------------------------------------------------------
+/*
+ * Programs frames[frame_nvm] one NVMCTRL command at a time and returns
+ * whenever NVMCTRL is busy, so uart_task() keeps receiving meanwhile.
+ */
+static void flash_task(void)
+{
+  bl_frame_t *frame = &frames[frame_nvm];
+
+  if (BL_FRAME_FREE == frame->state || 0 == NVMCTRL->INTFLAG.bit.READY)
+    return;
+
+  if (BL_FRAME_QUEUED == frame->state) {
+    const uint32_t *flash = (const uint32_t *)frame->addr;
+    bool same = true, blank = true;
+
+    frame->state = BL_FRAME_PROGRAM;
+
+    // Frames only erase a row when the page cannot be written otherwise,
+    // the legacy protocol erases it with its first page.
+    if (BL_CMD_SOF == frame->cmd) {
+      blank = 0 != frame->addr % ERASE_BLOCK_SIZE;
+      same = false;
+    } else {
+      for (int i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        same &= flash[i] == frame_data[frame_nvm][i];
+        blank &= flash[i] == 0xFFFFFFFF;
       }
-      continue;
     }
-    if (bl_status == BL_STATUS_CRC) {
-      flash_crc |= (data << flash_offset);
-      flash_offset += 8;
-      if (flash_offset == 32) {
-        bl_status = BL_STATUS_CRC_OK;
-        uart_putc(BL_CMD_FLASH);
-      }
+
+    if (same) {
+      frame->status = BL_CMD_SAME;
+      frame->state = BL_FRAME_VERIFY;
+    } else if (!blank) {
+      // Lock region size is always bigger than the row size
+      flash_command(frame->addr, NVMCTRL_CTRLA_CMD_UR);
+      flash_command(frame->addr, NVMCTRL_CTRLA_CMD_ER);
+      if (BL_CMD_SOF != frame->cmd)
+        frame->status = BL_CMD_ERASED;
     }
+    return;
+  }
+
+  if (BL_FRAME_PROGRAM == frame->state) {
+    flash_write_page(frame->addr, frame_data[frame_nvm]);
+    frame->state = BL_FRAME_VERIFY;
+    return;
   }
+
+#if BL_VERIFY_WRITE
+  if (dsu_crc(frame->addr, FLASH_PAGE_SIZE) != frame->crc)
+    frame->status = BL_CMD_NACK;
+#endif
+  frame_status(frame);
+  frame->state = BL_FRAME_FREE;
+  frame_nvm = (frame_nvm + 1) % BL_WINDOW;
 }
 
 //-----------------------------------------------------------------------------
-static void flash_task(void)
+// Program everything queued, e.g. before the bootloader resets.
+static void flash_drain(void)
 {
-  if (bl_status != BL_STATUS_CRC_OK) {
-    // This should never happen. It's here for safety purposes.
-    return;
-  }
+  while (BL_FRAME_FREE != frames[frame_nvm].state)
+    flash_task();
+}
 
-  uint32_t *ram_buf = (uint32_t *)flash_buffer;
-  uint32_t *flash_buf = (uint32_t *)flash_addr;
-  NVMCTRL->ADDR.reg = flash_addr >> 1;
+//-----------------------------------------------------------------------------
+// Commands without a page, the frame queue has been drained.
+static void bl_run(uint8_t cmd)
+{
+  uint32_t caps = BL_FLOW_CONTROL ? BL_CAP_FLOW : 0;
 
-  if (0 == (flash_addr % ERASE_BLOCK_SIZE))
-  {
-    // Lock region size is always bigger than the row size
-    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_UR;
-    while (0 == NVMCTRL->INTFLAG.bit.READY); // Unlocking is a fast operation
+  switch (cmd) {
+    case BL_CMD_RESET:
+      ram[0] = ram[1] = ram[2] = ram[3] = 0;
+      NVIC_SystemReset();
+      break;
 
-    // Erase the memory
-    NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | NVMCTRL_CTRLA_CMD_ER;
-    while (0 == NVMCTRL->INTFLAG.bit.READY);
-  }
+    case BL_CMD_INFO:
+      // A capability bit for every command, bit (command % 32).
+      for (unsigned i = 0; i < sizeof(bl_commands) / sizeof(bl_commands[0]); i++)
+        caps |= 1ul << (bl_commands[i].cmd % 32);
+      uart_putc(BL_CMD_ACK);
+      uart_putc(BL_VERSION);
+      uart_putc(BL_WINDOW);
+      uart_put32(caps);
+      break;
 
-  // Reprogram memory
-  for (int i = 0; i < DATA_SIZE / 4; i++)
-    flash_buf[i] = ram_buf[i];
+#if BL_SET_BAUD
+    case BL_CMD_BAUD:
+      uart_switch_baud(bl_header[0]);
+      break;
+#endif
 
-  while (!NVMCTRL->INTFLAG.bit.READY);
+#if BL_STATS
+    case BL_CMD_STATS:
+      uart_putc(BL_CMD_ACK);
+      uart_putc(rx_overruns);
+      uart_putc(rx_overruns >> 8);
+      break;
+#endif
 
-  DSU->ADDR.reg = flash_addr;
-  DSU->DATA.reg = 0xFFFFFFFF;
-  DSU->LENGTH.reg = FLASH_PAGE_SIZE;
-  DSU->CTRL.reg = DSU_CTRL_CRC;
-  DSU->STATUSA.reg = DSU_STATUSA_DONE | DSU_STATUSA_BERR;
+#if BL_ROW_CRCS
+    case BL_CMD_CRCS:
+      uart_putc(BL_CMD_ACK);
+      uart_put_crcs(APPLICATION_START, FLASH_SIZE - APPLICATION_START, ERASE_BLOCK_SIZE);
+      break;
+#endif
 
-  while (!(DSU->STATUSA.reg & DSU_STATUSA_DONE));
+#if BL_RANGE_CRC
+    case BL_CMD_CRC:
+      // Address and size, both word aligned and within flash.
+      if (0 == (bl_header[0] | bl_header[1]) % 4 && bl_header[1] &&
+          bl_header[0] <= FLASH_SIZE && bl_header[1] <= FLASH_SIZE - bl_header[0]) {
+        uart_putc(BL_CMD_ACK);
+        uart_put_crcs(bl_header[0], bl_header[1], bl_header[1]);
+      } else {
+        uart_putc(BL_CMD_NACK);
+      }
+      break;
+#endif
+  }
+}
 
+//-----------------------------------------------------------------------------
+static void uart_task(void)
+{
+  bl_frame_t *frame = &frames[frame_rx];
+  int data;
+
+  // The next page buffer is still being programmed. With flow control the
+  // host stops sending meanwhile, SERCOM holds the bytes already on the way.
+  if (BL_FRAME_FREE != frame->state) {
+#if BL_FLOW_CONTROL
+    HAL_GPIO_RTS_set();
+#endif
+    return;
+  }
+#if BL_FLOW_CONTROL
+  HAL_GPIO_RTS_clr();
+#endif
+
+  data = uart_getc();
+  if (data < 0) {
+    // A frame the host stopped sending halfway is dropped.
+    if (bl_timeout())
+      bl_status = BL_STATUS_READY;
+    return;
+  }
+  SysTick->VAL = 0;
+
+  if (BL_STATUS_READY == bl_status) {
+    for (bl_command = bl_commands; bl_command->cmd != data; bl_command++)
+      if (bl_command == &bl_commands[sizeof(bl_commands) / sizeof(bl_commands[0]) - 1])
+        return;
+    bl_status = BL_STATUS_HEADER;
+    bl_dst = (uint8_t *)bl_header;
+    bl_left = bl_command->size;
+    frame->cmd = data;
+    frame->flags = bl_command->flags;
+  } else {
+    *bl_dst++ = data;
+    if (--bl_left)
+      return;
+  }
 
-  if (!(DSU->STATUSA.reg & DSU_STATUSA_BERR) && ~flash_crc == DSU->DATA.reg) {
+  // The legacy protocol acknowledges every step.
+  if (BL_CMD_SOF == frame->cmd && BL_STATUS_CRC != bl_status)
     uart_putc(BL_CMD_ACK);
-  } else {
-    uart_putc(BL_CMD_NACK);
+  if (bl_left)
+    return;
+
+  if (BL_STATUS_HEADER == bl_status) {
+    if (0 == (frame->flags & BL_FLAG_FRAME)) {
+      bl_status = BL_STATUS_READY;
+      flash_drain();
+      bl_run(frame->cmd);
+      return;
+    }
+    frame->addr = bl_header[0];
+    frame->seq = bl_header[1];
+    bl_status = BL_STATUS_DATA;
+    bl_dst = (uint8_t *)frame_data[frame_rx];
+    bl_left = DATA_SIZE;
+    return;
+  }
+
+  if (BL_STATUS_DATA == bl_status) {
+    bl_status = BL_STATUS_CRC;
+    bl_dst = (uint8_t *)&frame->crc;
+    bl_left = 4;
+    return;
   }
+
   bl_status = BL_STATUS_READY;
+  if (BL_CMD_SOF == frame->cmd)
+    uart_putc(BL_CMD_FLASH);
+
+  // Frames may only write pages of the application, and only what arrived
+  // intact. Both are refused before the old contents are touched.
+  frame->status = BL_CMD_NACK;
+  if (frame->addr < APPLICATION_START || frame->addr >= FLASH_SIZE ||
+      frame->addr % FLASH_PAGE_SIZE ||
+      dsu_crc((uint32_t)frame_data[frame_rx], DATA_SIZE) != frame->crc) {
+    frame_status(frame);
+    return;
+  }
+  frame->status = BL_CMD_ACK;
+  frame->state = BL_FRAME_QUEUED;
+  frame_rx = (frame_rx + 1) % BL_WINDOW;
 }
 
 //-----------------------------------------------------------------------------
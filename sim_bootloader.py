@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+# sim_bootloader.py - Host side models of the bootloader in this repository
+
+# Copyright (C) 2018 EmbeddedEnterprises
+# Martin Koppehel <martin.koppehel@st.ovgu.de>
+
+# This software may be modified and distributed under the terms
+# of the MIT license.  See the LICENSE file for details.
+
+# The models follow main.c closely enough to reason about timing without
+# hardware. Run this file for the tables, test_bootloader.py checks the same
+# models.
+
+PAGE_SIZE = 64
+PAGES_IN_ROW = 4
+APPLICATION_START = 0x800
+FLASH_SIZE = 0x4000
+APP_PAGES = (FLASH_SIZE - APPLICATION_START) // PAGE_SIZE
+BL_WINDOW = 4
+
+# NVMCTRL timing, SAMD10 datasheet maximum values.
+T_ERASE = 6e-3
+T_WRITE = 2.5e-3
+
+RATES = (57600, 115200, 230400, 460800, 1000000)
+# Round trip added by the USB-serial adapter: none, typical CP210x/CH340,
+# FTDI with a tuned and with the default 16 ms latency timer.
+ROUND_TRIPS = (0, 1e-3, 4e-3, 32e-3)
+
+
+def byte_time(baud):
+    # Start bit, 8 data bits and a stop bit.
+    return 10 / baud
+
+
+def stop_and_wait(pages, baud, rtt):
+    # SOF, address, data and CRC each wait for their answer, the last answer
+    # (BL_CMD_FLASH, then ACK) comes once the page is programmed.
+    t = 0
+    for page in range(pages):
+        for size, reply in ((1, 1), (4, 1), (PAGE_SIZE, 1), (4, 2)):
+            t += (size + reply) * byte_time(baud) + rtt
+        t += (T_ERASE if page % PAGES_IN_ROW == 0 else 0) + T_WRITE
+    return t
+
+
+def pipelined(pages, baud, rtt, window, frame, reply, changed_rows=None):
+    # The host keeps `window` frames of `frame` bytes in flight, the device
+    # programs them in order and answers each with `reply` bytes. A frame is
+    # received while NVMCTRL still works on the previous ones. Pages of rows
+    # not in `changed_rows` are already in flash and only compared.
+    host = 0
+    nvm = 0
+    acked = []
+    for page in range(pages):
+        host = max(host, acked[page - window] if page >= window else 0) + frame * byte_time(baud)
+        nvm = max(nvm, host + rtt / 2)
+        if changed_rows is None or page // PAGES_IN_ROW in changed_rows:
+            if page % PAGES_IN_ROW == 0:
+                nvm += T_ERASE
+            nvm += T_WRITE
+        acked.append(nvm + reply * byte_time(baud) + rtt / 2)
+    return acked[-1]
+
+
+def page_frames(pages, baud, rtt):
+    # BL_CMD_PAGE: command, address, data and CRC, one status byte.
+    return pipelined(pages, baud, rtt, 1, 1 + 4 + PAGE_SIZE + 4, 1)
+
+
+def windowed(pages, baud, rtt, window=BL_WINDOW, changed_rows=None):
+    # BL_CMD_WINDOW: command, address, sequence, data and CRC, status and sequence.
+    return pipelined(pages, baud, rtt, window, 1 + 4 + 1 + PAGE_SIZE + 4, 2, changed_rows)
+
+
+def print_transfer_table(pages=APP_PAGES):
+    print(f'Seconds for {pages} pages, stop-and-wait / page frames / window of {BL_WINDOW}:')
+    for rtt in ROUND_TRIPS:
+        for baud in RATES:
+            old = stop_and_wait(pages, baud, rtt)
+            new = windowed(pages, baud, rtt)
+            print(f'  {rtt * 1e3:4.0f} ms {baud:8} baud: {old:6.2f} {page_frames(pages, baud, rtt):6.2f} '
+                  f'{new:6.2f}  x{old / new:.1f}')
+
+
+if __name__ == '__main__':
+    print_transfer_table()
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+
+# test_bootloader.py - Checks of the host side models in sim_bootloader.py
+# and of the recovery logic in upload.py
+
+# Copyright (C) 2018 EmbeddedEnterprises
+# Martin Koppehel <martin.koppehel@st.ovgu.de>
+
+# This software may be modified and distributed under the terms
+# of the MIT license.  See the LICENSE file for details.
+
+import binascii
+import contextlib
+import io
+import unittest
+
+import sim_bootloader as sim
+import upload
+
+
+class TransferTest(unittest.TestCase):
+    def test_window_beats_stop_and_wait(self):
+        # Everything but a raw UART link pays for the round trips.
+        for baud in sim.RATES:
+            for rtt in sim.ROUND_TRIPS:
+                old = sim.stop_and_wait(sim.APP_PAGES, baud, rtt)
+                new = sim.windowed(sim.APP_PAGES, baud, rtt)
+                self.assertLess(new, old / (1.1 if rtt == 0 else 1.5), (baud, rtt))
+
+    def test_page_frames_save_three_round_trips(self):
+        # A page frame waits once per page, stop-and-wait four times.
+        for baud in sim.RATES:
+            for rtt in sim.ROUND_TRIPS[1:]:
+                old = sim.stop_and_wait(sim.APP_PAGES, baud, rtt)
+                new = sim.page_frames(sim.APP_PAGES, baud, rtt)
+                self.assertLess(new, old - 2.9 * rtt * sim.APP_PAGES, (baud, rtt))
+
+    def test_window_is_bound_by_wire_or_flash(self):
+        # With the window covering the round trip, the slower of the wire and
+        # NVMCTRL sets the pace. Two buffers do not get there at every rate.
+        for baud in sim.RATES:
+            wire = sim.APP_PAGES * (6 + sim.PAGE_SIZE + 4) * sim.byte_time(baud)
+            flash = sim.APP_PAGES * (sim.T_WRITE + sim.T_ERASE / sim.PAGES_IN_ROW)
+            self.assertLess(sim.windowed(sim.APP_PAGES, baud, 1e-3), 1.05 * max(wire, flash) + 0.02)
+        self.assertGreater(sim.windowed(sim.APP_PAGES, 115200, 1e-3, 2),
+                           1.05 * sim.windowed(sim.APP_PAGES, 115200, 1e-3))
+
+    def test_unchanged_rows_are_bound_by_the_wire(self):
+        # Pages already in flash skip NVMCTRL, only the wire time is left.
+        for baud in sim.RATES:
+            wire = sim.APP_PAGES * (6 + sim.PAGE_SIZE + 4) * sim.byte_time(baud)
+            same = sim.windowed(sim.APP_PAGES, baud, 1e-3, changed_rows=set())
+            self.assertLess(same, 1.05 * wire + 0.02, baud)
+        full = sim.windowed(sim.APP_PAGES, 1000000, 1e-3)
+        self.assertLess(sim.windowed(sim.APP_PAGES, 1000000, 1e-3, changed_rows={0, 1}), full / 4)
+
+
+class RecoveryTest(unittest.TestCase):
+    def setUp(self):
+        self.image = bytearray(range(256)) * (sim.FLASH_SIZE // 256)
+        self.pages = list(range(sim.APPLICATION_START, sim.FLASH_SIZE, sim.PAGE_SIZE))
+        self.row = sim.PAGE_SIZE * sim.PAGES_IN_ROW
+
+    def test_rows_that_differ_go_out_whole(self):
+        crcs = [binascii.crc32(self.image[r:r+self.row])
+                for r in range(sim.APPLICATION_START, sim.FLASH_SIZE, self.row)]
+        crcs[2] ^= 1
+        start = sim.APPLICATION_START + 2 * self.row
+        self.assertEqual(upload.changed_pages(self.image, self.pages, crcs, sim.APPLICATION_START),
+                         list(range(start, start + self.row, sim.PAGE_SIZE)))
+
+    def test_erased_pages_of_blank_rows_are_skipped(self):
+        blank = binascii.crc32(b'\xff' * self.row)
+        crcs = [blank] * ((sim.FLASH_SIZE - sim.APPLICATION_START) // self.row)
+        self.image[sim.APPLICATION_START + sim.PAGE_SIZE:sim.FLASH_SIZE] = \
+            b'\xff' * (sim.FLASH_SIZE - sim.APPLICATION_START - sim.PAGE_SIZE)
+        self.assertEqual(upload.changed_pages(self.image, self.pages, crcs, sim.APPLICATION_START),
+                         [sim.APPLICATION_START])
+
+    def test_erased_row_is_sent_again(self):
+        # Pages of the row written before the erase are lost, others are not.
+        row = sim.APPLICATION_START + self.row
+        done = {row - sim.PAGE_SIZE, row, row + sim.PAGE_SIZE}
+        with contextlib.redirect_stdout(io.StringIO()):
+            pending = upload.page_done(done, [row + 3 * sim.PAGE_SIZE], row + 2 * sim.PAGE_SIZE,
+                                       upload.ERASED, len(self.pages))
+        self.assertEqual(pending, [row, row + sim.PAGE_SIZE, row + 3 * sim.PAGE_SIZE])
+        self.assertEqual(done, {row - sim.PAGE_SIZE, row + 2 * sim.PAGE_SIZE})
+
+
+if __name__ == '__main__':
+    unittest.main()
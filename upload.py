@@ -14,161 +14,448 @@ import math
 import serial
 import struct
 import sys
+import time
 
-parser = argparse.ArgumentParser(description='Upload a hexfile using our bootloader')
-parser.add_argument('--version', '-V', help='Display version which doesn\'t exist', action='store_true')
-parser.add_argument('--verbose', '-v', help='Display unneccessary output you won\'t understand', action='store_true')
-parser.add_argument('--bl-size', help='Bootloader Size (ensures that the memory area will not be overwritten)', default='0x400', type=str)
-parser.add_argument('--fl-size', help='Flash Size (ensures that only existent flash will be written)', default='0x4000', type=str)
-parser.add_argument('--bl-init', help='Sequence to reboot to the bootloader (hexstring)', type=str)
-parser.add_argument('--strict', '-s', help='Exit in case a memory conflict is detected.', action='store_true')
-parser.add_argument('--page-size', help='Flash page size, usualle 64 byte', default='64')
-parser.add_argument('serial', metavar='PORT', type=str, nargs='?', help='The serial port to use', default='/dev/ttyUSB0')
-parser.add_argument('hexfile', metavar='HEX', type=str, nargs='?', help='The hex file to upload', default='main.hex')
-args = parser.parse_args()
-
-print('UART-Bootloader Upload-Tool')
-if args.version:
-    print('(c) Martin Koppehel 2018')
-    print('(c) EmbeddedEnterprises 2018')
-    print('Version 0.1.0')
-    sys.exit(0)
-
-if args.verbose:
-    print('You asked for unneccessary information. (-v)')
-    if args.strict:
-        print('Strict mode enabled, checking memory accesses.')
-
-flashmin = int(args.bl_size, 0)
-flashmax = int(args.fl_size, 0)
-pagesize = int(args.page_size, 0)
-if args.verbose:
-    print(f'Valid flash range: {flashmin} to {flashmax}')
-
-with open(args.hexfile, 'r') as hex_file:
-    hex_content = hex_file.readlines()
-
-if args.verbose:
-    print(f'Read hexfile with {len(hex_content)} lines')
-
-memory_view = bytearray(flashmax)
-index = 0
-global_offset = 0
-last_addr = 0
-for line in hex_content:
-    line = line.strip()
-    if line[0] != ':':
-        print(f'Invalid hexfile: Expected \':\' at {index}:0')
-        sys.exit(1)
-    chksum = 0
-    for i in range(1, len(line) - 2, 2):
-        chksum += int(line[i:i+2], 16)
-    chksum = (((~(chksum & 0xFF)) & 0xFF) + 1) & 0xFF
-    if chksum != int(line[-2:], 16):
-        print(f'Checksum failed on line: {index}, expected: {chksum}, got: {int(line[-2:], 16)}')
-        sys.exit(3)
-
-    payload_len = int(line[1:3], 16)
-    payload_offset = int(line[3:7], 16)
-    rectype = int(line[7:9], 16)
-    if rectype == 1:
-        if args.verbose:
-            print('Hexfile end')
-        break
-    if rectype > 1:
-        if args.verbose:
-            print(f'unknown rectype: {rectype:02X}, ignoring.')
-        continue
-    for i in range(0, payload_len):
-        addr = global_offset + payload_offset + i
-        if args.strict and addr < flashmin and rectype == 0:
-            print(f'Hexfile contains data within the bootloader section (line: {index})')
-            sys.exit(2)
-        if args.strict and addr >= flashmax and rectype == 0:
-            print(f'Hexfile contains data after the end of the flash (line: {index})')
-            sys.exit(2)
-        start_idx = 9 + 2 * i
-        end_idx = start_idx + 2
-        cur_addr = payload_offset + global_offset + i
-        memory_view[cur_addr] = int(line[start_idx:end_idx], 16)
-        last_addr = max(last_addr, cur_addr)
-    index += 1
-
-
-if args.verbose:
-    print(f'Got {last_addr - flashmin} bytes of data')
-no_pages = math.ceil(last_addr / pagesize)
-last_addr = no_pages * pagesize
-no_pages -= math.floor(flashmin / pagesize)
-if args.verbose:
-    print(f'Padded data to {flashmin-last_addr:05} bytes ({no_pages} pages)')
-
-print(f'Flashing your device.')
-index = 1
-cur_page = flashmin
-with serial.Serial(args.serial, 57600, timeout=3) as port:
-    if args.bl_init:
-        init_seq = bytes.fromhex(args.bl_init)
-        if args.verbose:
-            print('Sending init sequence: {binascii.hexlify(init_seq)}')
-        port.write(init_seq)
-        resp = port.read()
-        if resp != b'\x01':
-            print('Failed to trigger bootloader, maybe your init sequence isn\'t matching?')
-            sys.exit(4)
-    elif args.verbose:
-        print('Assuming bootloader is present.')
+CMD_SOF = 0xa0
+CMD_RESET = 0xa2
+CMD_WINDOW = 0xa3
+CMD_PAGE = 0xa4
+CMD_INFO = 0xa5
+CMD_BAUD = 0xa6
+CMD_STATS = 0xa7
+CMD_CRCS = 0xa8
+CMD_CRC = 0xa9
+ACK = 0x55
+SAME = 0x56
+ERASED = 0x57
+NACK = 0x66
+DEFAULT_BAUD = 57600
+CAP_FLOW = 1 << 31
+FLOW_WINDOW = 128 # Half the sequence numbers, flow control paces the rest
+
+
+def cap(cmd):
+    # BL_CMD_INFO reports one capability bit per command.
+    return 1 << (cmd % 32)
+
+verbose = False
+pagesize = 64
+rowsize = 4 * pagesize
+retries = 3
+
+
+def page_crc(memory_view, addr):
+    return binascii.crc32(memory_view[addr:addr+pagesize]) & 0xFFFFFFFF
+
+
+def row_of(addr):
+    return addr - addr % rowsize
+
+
+def query_info(port):
+    # Bootloaders without BL_CMD_INFO ignore the request.
+    port.timeout = 0.2
+    port.write(bytes([CMD_INFO]))
+    resp = port.read(7)
+    port.timeout = 3
+    if len(resp) != 7 or resp[0] != ACK:
+        port.reset_input_buffer()
+        return None
+    return {'version': resp[1], 'window': resp[2], 'caps': struct.unpack('<I', resp[3:])[0]}
+
+
+def query_overruns(port):
+    port.write(bytes([CMD_STATS]))
+    resp = port.read(3)
+    if len(resp) != 3 or resp[0] != ACK:
+        return None
+    return struct.unpack('<H', resp[1:])[0]
+
+
+def query_crcs(port, rows):
+    # One CRC32 per row of the application, in address order.
+    port.write(bytes([CMD_CRCS]))
+    resp = port.read(1 + 4 * rows)
+    if len(resp) != 1 + 4 * rows or resp[0] != ACK:
+        return None
+    return struct.unpack(f'<{rows}I', resp[1:])
 
-    while cur_page != last_addr:
-        if args.verbose:
+
+def query_crc(port, addr, size):
+    port.write(struct.pack('<BII', CMD_CRC, addr, size))
+    resp = port.read(5)
+    if len(resp) != 5 or resp[0] != ACK:
+        return None
+    return struct.unpack('<I', resp[1:])[0]
+
+
+def changed_pages(memory_view, pages, crcs, flashmin):
+    # The pages of rows whose CRC differs from the image. Rows that are
+    # erased on the device need no pages of 0xFF.
+    blank_row = binascii.crc32(b'\xff' * rowsize)
+    changed = []
+    for p in pages:
+        crc = crcs[(row_of(p) - flashmin) // rowsize]
+        if crc == binascii.crc32(memory_view[row_of(p):row_of(p)+rowsize]):
+            continue
+        if crc == blank_row and memory_view[p:p+pagesize] == b'\xff' * pagesize:
+            continue
+        changed.append(p)
+    return changed
+
+
+def switch_baud(port, rate):
+    port.write(struct.pack('<BI', CMD_BAUD, rate))
+    if port.read() != bytes([ACK]):
+        print(f'Bootloader refused {rate} baud, staying at {DEFAULT_BAUD}.')
+        return
+    port.baudrate = rate
+    port.timeout = 0.3
+    port.write(bytes([ACK]))
+    resp = port.read()
+    port.timeout = 3
+    if resp == bytes([ACK]):
+        if verbose:
+            print(f'Switched to {rate} baud.')
+        return
+    # The bootloader falls back as well once its probe timeout (0.5s) expired.
+    print(f'Switching to {rate} baud failed, staying at {DEFAULT_BAUD}.')
+    port.baudrate = DEFAULT_BAUD
+    time.sleep(0.6)
+    port.reset_input_buffer()
+
+
+def flash_stop_and_wait(port, memory_view, pages):
+    for index, cur_page in enumerate(pages, 1):
+        if verbose:
             print(f'SOF -> 0xa0')
-        port.write(b'\xa0')
+        port.write(bytes([CMD_SOF]))
         if port.read() != b'\x55':
             print('No ACK for SOF. Exiting.')
             sys.exit(4)
-        elif args.verbose:
+        elif verbose:
             print(f'SOF <- ACK')
 
-        if args.verbose:
+        if verbose:
             print(f'ADDR-> 0x{cur_page & 0xFF:02X}{(cur_page >> 8) & 0xFF:02X}{(cur_page >> 16) & 0xFF:02X}{(cur_page >> 24) & 0xFF:02X}')
         addr = struct.pack('<I', cur_page)
         port.write(addr)
         if port.read() != b'\x55':
             print('No ACK for ADDR. Exiting.')
             sys.exit(4)
-        elif args.verbose:
+        elif verbose:
             print(f'ADDR<- ACK')
 
-        if args.verbose:
+        if verbose:
             print(f'DATA-> {binascii.hexlify(memory_view[cur_page:cur_page+pagesize])}')
         port.write(bytes(memory_view[cur_page:cur_page+pagesize]))
         if port.read() != b'\x55':
             print('No ACK for DATA. Exiting.')
             sys.exit(4)
-        elif args.verbose:
+        elif verbose:
             print(f'DATA<- ACK')
 
-        chksum = binascii.crc32(memory_view[cur_page:cur_page+pagesize]) & 0xFFFFFFFF
-        if args.verbose:
+        chksum = page_crc(memory_view, cur_page)
+        if verbose:
             print(f'CHK -> {chksum:08X}')
         port.write(struct.pack('<I', chksum))
         if port.read() != b'\x77':
             print('No ACK for CHK. Exiting.')
             sys.exit(4)
-        elif args.verbose:
+        elif verbose:
             print(f'CHK <- ACK')
 
         if port.read() != b'\x55':
             print('Flash failed. Exiting.')
             sys.exit(4)
-        print(f'Page {index}/{no_pages} written.')
-        elif args.verbose:
+        print(f'Page {index}/{len(pages)} written.')
+        if verbose:
             print('-'*80)
-        cur_page+=pagesize
+
+
+def resync(port):
+    # The bootloader drops a frame it stopped receiving after 0.5s, wait
+    # until the line has been quiet for longer than that.
+    port.timeout = 0.6
+    while port.read(64):
+        pass
+    port.timeout = 3
+
+
+def redo_pages(redo, pending, failures):
+    # Refused or lost pages go out again. Where the bootloader has to erase a
+    # row for them, page_done() sends the rest of that row as well.
+    cur_page = redo[0]
+    failures[cur_page] = failures.get(cur_page, 0) + 1
+    if failures[cur_page] > retries:
+        print(f'Flash failed at 0x{cur_page:08X}. Exiting.')
+        sys.exit(4)
+    return redo + [p for p in pending if p not in redo]
+
+
+def page_done(done, pending, cur_page, status, total):
+    # A row the bootloader erased to program cur_page lost the pages of it
+    # programmed before, they go out again.
+    if status == ERASED:
+        redo = sorted(p for p in done if row_of(p) == row_of(cur_page) and p != cur_page)
+        done.difference_update(redo)
+        pending = redo + [p for p in pending if p not in redo]
+    done.add(cur_page)
+    print(f'Page {len(done)}/{total} {"unchanged" if status == SAME else "written"}.')
+    return pending
+
+
+def flash_page_frames(port, memory_view, pages):
+    # One frame and one reply per page.
+    pending = list(pages)
+    failures = {}
+    done = set()
+    while pending:
+        cur_page = pending.pop(0)
+        if verbose:
+            print(f'PAGE-> addr 0x{cur_page:08X}')
+        port.write(struct.pack('<BI', CMD_PAGE, cur_page) +
+                   memory_view[cur_page:cur_page+pagesize] +
+                   struct.pack('<I', page_crc(memory_view, cur_page)))
+        reply = port.read()
+        if reply == bytes([NACK]):
+            if verbose:
+                print(f'PAGE<- NACK')
+            pending = redo_pages([cur_page], pending, failures)
+        elif reply and reply[0] in (ACK, SAME, ERASED):
+            pending = page_done(done, pending, cur_page, reply[0], len(pages))
+        else:
+            if verbose:
+                print(f'PAGE<- no valid response')
+            resync(port)
+            pending = redo_pages([cur_page], pending, failures)
+
+
+def flash_windowed(port, memory_view, pages, window):
+    # Keep up to `window` frames in flight. The bootloader answers every frame
+    # with its status and sequence number, in the order the frames were sent.
+    # Only frames refused on reception are answered right away, so any other
+    # status covers every frame sent before it as well, with ACK.
+    pending = list(pages)
+    inflight = {}
+    failures = {}
+    done = set()
+    seq = 0
+    while pending or inflight:
+        while pending and len(inflight) < window:
+            cur_page = pending.pop(0)
+            if verbose:
+                print(f'WIN -> seq {seq:02X} addr 0x{cur_page:08X}')
+            port.write(struct.pack('<BIB', CMD_WINDOW, cur_page, seq) +
+                       memory_view[cur_page:cur_page+pagesize] +
+                       struct.pack('<I', page_crc(memory_view, cur_page)))
+            inflight[seq] = cur_page
+            seq = (seq + 1) & 0xFF
+
+        reply = port.read(2)
+        if len(reply) != 2 or reply[0] not in (ACK, SAME, ERASED, NACK) or reply[1] not in inflight:
+            if verbose:
+                print(f'WIN <- no valid response')
+            resync(port)
+            lost = list(inflight.values())
+            inflight.clear()
+            pending = redo_pages(lost, pending, failures)
+            continue
+        status, seq_done = reply
+        if status == NACK:
+            cur_page = inflight.pop(seq_done)
+            if verbose:
+                print(f'WIN <- NACK seq {seq_done:02X} addr 0x{cur_page:08X}')
+            pending = redo_pages([cur_page], pending, failures)
+            continue
+
+        for sent in list(inflight):
+            cur_page = inflight.pop(sent)
+            if sent == seq_done:
+                pending = page_done(done, pending, cur_page, status, len(pages))
+                break
+            pending = page_done(done, pending, cur_page, ACK, len(pages))
+
+
+def flash_pages(port, memory_view, pages, caps, window):
+    if caps & cap(CMD_WINDOW) and window > 1:
+        flash_windowed(port, memory_view, pages, window)
+    elif caps & cap(CMD_PAGE):
+        flash_page_frames(port, memory_view, pages)
+    else:
+        flash_stop_and_wait(port, memory_view, pages)
+
+
+def main():
+    global verbose, pagesize, rowsize
+
+    parser = argparse.ArgumentParser(description='Upload a hexfile using our bootloader')
+    parser.add_argument('--version', '-V', help='Display version which doesn\'t exist', action='store_true')
+    parser.add_argument('--verbose', '-v', help='Display unneccessary output you won\'t understand', action='store_true')
+    parser.add_argument('--bl-size', help='Bootloader Size (ensures that the memory area will not be overwritten)', default='0x800', type=str)
+    parser.add_argument('--fl-size', help='Flash Size (ensures that only existent flash will be written)', default='0x4000', type=str)
+    parser.add_argument('--bl-init', help='Sequence to reboot to the bootloader (hexstring)', type=str)
+    parser.add_argument('--strict', '-s', help='Exit in case a memory conflict is detected.', action='store_true')
+    parser.add_argument('--page-size', help='Flash page size, usualle 64 byte', default='64')
+    parser.add_argument('--baud', '-b', help=f'Switch to this baud rate after connecting (up to 1000000), falls back to {DEFAULT_BAUD}', default=str(DEFAULT_BAUD))
+    parser.add_argument('--window', '-w', help='Pages in flight using the windowed protocol, 0 sends one page at a time (default: as advertised by the bootloader)', type=str)
+    parser.add_argument('--full', '-f', help='Send every page, even rows the bootloader already has', action='store_true')
+    parser.add_argument('--rtscts', help=f'Use RTS/CTS flow control and keep up to {FLOW_WINDOW} pages in flight, needs a bootloader built with BL_FLOW_CONTROL', action='store_true')
+    parser.add_argument('serial', metavar='PORT', type=str, nargs='?', help='The serial port to use', default='/dev/ttyUSB0')
+    parser.add_argument('hexfile', metavar='HEX', type=str, nargs='?', help='The hex file to upload', default='main.hex')
+    args = parser.parse_args()
+
+    print('UART-Bootloader Upload-Tool')
+    if args.version:
+        print('(c) Martin Koppehel 2018')
+        print('(c) EmbeddedEnterprises 2018')
+        print('Version 0.1.0')
+        sys.exit(0)
+
+    verbose = args.verbose
+    if verbose:
+        print('You asked for unneccessary information. (-v)')
+        if args.strict:
+            print('Strict mode enabled, checking memory accesses.')
+
+    flashmin = int(args.bl_size, 0)
+    flashmax = int(args.fl_size, 0)
+    pagesize = int(args.page_size, 0)
+    rowsize = 4 * pagesize
+    if verbose:
+        print(f'Valid flash range: {flashmin} to {flashmax}')
+
+    with open(args.hexfile, 'r') as hex_file:
+        hex_content = hex_file.readlines()
+
+    if verbose:
+        print(f'Read hexfile with {len(hex_content)} lines')
+
+    # Gaps read as erased flash.
+    memory_view = bytearray(b'\xff' * flashmax)
+    index = 0
+    global_offset = 0
+    last_addr = 0
+    for line in hex_content:
+        line = line.strip()
+        if line[0] != ':':
+            print(f'Invalid hexfile: Expected \':\' at {index}:0')
+            sys.exit(1)
+        chksum = 0
+        for i in range(1, len(line) - 2, 2):
+            chksum += int(line[i:i+2], 16)
+        chksum = (((~(chksum & 0xFF)) & 0xFF) + 1) & 0xFF
+        if chksum != int(line[-2:], 16):
+            print(f'Checksum failed on line: {index}, expected: {chksum}, got: {int(line[-2:], 16)}')
+            sys.exit(3)
+
+        payload_len = int(line[1:3], 16)
+        payload_offset = int(line[3:7], 16)
+        rectype = int(line[7:9], 16)
+        if rectype == 1:
+            if verbose:
+                print('Hexfile end')
+            break
+        if rectype > 1:
+            if verbose:
+                print(f'unknown rectype: {rectype:02X}, ignoring.')
+            continue
+        for i in range(0, payload_len):
+            addr = global_offset + payload_offset + i
+            # Always checked, applications linked for the 1k bootloader
+            # start at 0x400.
+            if addr < flashmin and rectype == 0:
+                print(f'Hexfile contains data within the bootloader section (line: {index}), '
+                      f'the application has to start at 0x{flashmin:X}')
+                sys.exit(2)
+            if args.strict and addr >= flashmax and rectype == 0:
+                print(f'Hexfile contains data after the end of the flash (line: {index})')
+                sys.exit(2)
+            start_idx = 9 + 2 * i
+            end_idx = start_idx + 2
+            cur_addr = payload_offset + global_offset + i
+            memory_view[cur_addr] = int(line[start_idx:end_idx], 16)
+            last_addr = max(last_addr, cur_addr + 1)
         index += 1
 
-    if args.verbose:
-        print(f'Rebooting device.')
-    port.write(b'\xa2')
 
-print('Finished.')
+    if verbose:
+        print(f'Got {last_addr - flashmin} bytes of data')
+    no_pages = math.ceil(last_addr / pagesize)
+    last_addr = no_pages * pagesize
+    no_pages -= math.floor(flashmin / pagesize)
+    if verbose:
+        print(f'Padded data to {last_addr-flashmin:05} bytes ({no_pages} pages)')
+    pages = list(range(flashmin, last_addr, pagesize))
+
+    print(f'Flashing your device.')
+    with serial.Serial(args.serial, DEFAULT_BAUD, timeout=3, rtscts=args.rtscts) as port:
+        if args.bl_init:
+            init_seq = bytes.fromhex(args.bl_init)
+            if verbose:
+                print(f'Sending init sequence: {binascii.hexlify(init_seq)}')
+            port.write(init_seq)
+            resp = port.read()
+            if resp != b'\x01':
+                print('Failed to trigger bootloader, maybe your init sequence isn\'t matching?')
+                sys.exit(4)
+        elif verbose:
+            print('Assuming bootloader is present.')
+
+        info = query_info(port)
+        if verbose:
+            print(f'Bootloader info: {info}')
+        caps = info['caps'] if info else 0
+        baud = int(args.baud, 0)
+        if baud != DEFAULT_BAUD:
+            if caps & cap(CMD_BAUD):
+                switch_baud(port, baud)
+            else:
+                print(f'Bootloader cannot switch the baud rate, staying at {DEFAULT_BAUD}.')
+        image = pages
+        rows = (flashmax - flashmin) // rowsize
+        if caps & cap(CMD_CRCS) and pages:
+            # Whole rows, so that the row CRCs match the image once written.
+            pages = image = list(range(flashmin, row_of(pages[-1]) + rowsize, pagesize))
+        if caps & cap(CMD_CRCS) and not args.full:
+            crcs = query_crcs(port, rows)
+            if crcs:
+                pages = changed_pages(memory_view, image, crcs, flashmin)
+                print(f'{len(pages)} pages in rows that differ.')
+        window = int(args.window, 0) if args.window else info['window'] if info else 0
+        if args.rtscts:
+            if caps & CAP_FLOW:
+                # The bootloader holds the host off while its buffers are full.
+                window = int(args.window, 0) if args.window else FLOW_WINDOW
+            else:
+                print('Bootloader has no flow control, ignoring --rtscts.')
+                port.rtscts = False
+        flash_pages(port, memory_view, pages, caps, window)
+
+        # Rows that still differ, e.g. after a lost reply, go out again.
+        for _ in range(retries if caps & cap(CMD_CRCS) else 0):
+            crcs = query_crcs(port, rows)
+            pages = changed_pages(memory_view, image, crcs, flashmin) if crcs else []
+            if not pages:
+                break
+            print(f'{len(pages)} pages in rows that still differ, sending them again.')
+            flash_pages(port, memory_view, pages, caps, window)
+
+        if caps & cap(CMD_CRC) and last_addr > flashmin:
+            crc = query_crc(port, flashmin, last_addr - flashmin)
+            if crc != binascii.crc32(memory_view[flashmin:last_addr]):
+                print('Image CRC does not match the hex file. Exiting.')
+                sys.exit(4)
+            print('Image CRC verified.')
+
+        if verbose and caps & cap(CMD_STATS):
+            print(f'Receive overruns: {query_overruns(port)}')
+        if verbose:
+            print(f'Rebooting device.')
+        port.write(bytes([CMD_RESET]))
+
+    print('Finished.')
+
+
+if __name__ == '__main__':
+    main()